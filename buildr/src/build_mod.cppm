@@ -2,6 +2,7 @@ module;
 
 #include <boost/algorithm/string/join.hpp>
 #include <boost/asio.hpp>
+#include <boost/container_hash/hash.hpp>
 #include <boost/describe/class.hpp>
 #include <boost/graph/adjacency_list.hpp>
 #include <boost/graph/topological_sort.hpp>
@@ -12,8 +13,14 @@ module;
 #include <filesystem>
 #include <format>
 #include <fstream>
+#include <functional>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
 #include <ranges>
+#include <sstream>
 #include <vector>
 
 #include "format.hpp"
@@ -29,6 +36,7 @@ import logging;
 import config_mod;
 import dependencies_mod;
 import scan_deps;
+import scheduler_mod;
 
 namespace builder {
 
@@ -41,10 +49,21 @@ namespace rv = r::views;
 
 using error_code = int;
 
+// Flags shared by every TU of a target, built once and referenced by all of
+// its compile commands rather than copied into each one
+using shared_args_t = std::shared_ptr<const std::vector<std::string>>;
+
 struct CompileCommand {
   fs::path out_file;
   fs::path compiler;
+  shared_args_t common_args;
   std::vector<std::string> args;
+
+  [[nodiscard]] auto all_args() const {
+    auto all = *common_args;
+    all.insert(all.end(), args.begin(), args.end());
+    return all;
+  }
 };
 
 auto is_module(const fs::path& p) { return p.extension() == ".cppm"; }
@@ -60,33 +79,110 @@ export auto get_build_path(const fs::path& root, const fs::path& build_root,
   return out;
 }
 
+export auto get_time_trace_path(const fs::path& build_path) {
+  return fs::path(build_path.string() + ".trace.json");
+}
+
+// A module interface is precompiled to a .pcm first so its importers can start
+// early, then the .pcm is compiled on its own into the object that gets linked
+auto get_object_path(const fs::path& build_path) {
+  if (build_path.extension() != ".pcm") return build_path;
+  return fs::path(build_path.string() + ".o");
+}
+
+auto get_module_path_args(const fs::path& build_root,
+                          const std::set<fs::path>& module_paths) {
+  return module_paths | rv::transform([build_root](const auto& p) {
+           return std::format("-fprebuilt-module-path={}", build_root / p);
+         }) |
+         r::to<std::vector>();
+}
+
+auto get_common_args(const fs::path& build_root,
+                     const config::BuildProfile& profile,
+                     const std::set<fs::path>& module_paths,
+                     const std::vector<std::string>& extra_args) {
+  // Profile flags go first so the project's own -O/-D flags override them
+  auto args = std::vector{profile.compile_args, extra_args,
+                          get_module_path_args(build_root, module_paths)} |
+              rv::join | r::to<std::vector>();
+
+  if (profile.thin_lto) args.emplace_back("-flto=thin");
+
+  return std::make_shared<const std::vector<std::string>>(std::move(args));
+}
+
 auto get_compile_command(const fs::path& root, const fs::path& build_root,
-                         const std::set<fs::path>& module_paths,
-                         const fs::path& source,
-                         const std::vector<std::string>& extra_args) {
-  const auto cpp_module = source.extension() == ".cppm";
+                         const config::BuildProfile& profile,
+                         const shared_args_t& common_args,
+                         const fs::path& source) {
+  const auto cpp_module = is_module(source);
   const auto out = get_build_path(root, build_root, source);
 
-  const auto m_paths =
-      module_paths | rv::transform([build_root](const auto& p) {
-        return std::format("-fprebuilt-module-path={}", build_root / p);
-      }) |
-      r::to<std::vector>();
+  std::vector<std::string> args;
+  if (cpp_module) args.emplace_back("--precompile");
+  if (profile.debug_info) args.emplace_back(cpp_module ? "-gmodules" : "-g");
 
-  auto args =
-      std::vector{extra_args, m_paths} | rv::join | r::to<std::vector>();
+  args.emplace_back("-o");
+  args.push_back(out);
+  args.emplace_back("-c");
+  args.push_back(source);
 
-  if (cpp_module) args.emplace_back("--precompile");
+  return CompileCommand{.out_file = out,
+                        .compiler = kCompiler,
+                        .common_args = common_args,
+                        .args = std::move(args)};
+}
+
+auto get_module_object_command(const config::BuildProfile& profile,
+                               const shared_args_t& common_args,
+                               const fs::path& pcm) {
+  const auto out = get_object_path(pcm);
 
-  const bool debug = true;
-  if (debug) args.emplace_back(cpp_module ? "-gmodules" : "-g");
+  // The shared flags carry the -O level and -flto, the preprocessor ones are
+  // unused with a .pcm input
+  std::vector<std::string> args{"-Wno-unused-command-line-argument"};
+  if (profile.debug_info) args.emplace_back("-g");
 
   args.emplace_back("-o");
   args.push_back(out);
   args.emplace_back("-c");
-  args.push_back(source);
+  args.push_back(pcm);
+
+  return CompileCommand{.out_file = out,
+                        .compiler = kCompiler,
+                        .common_args = common_args,
+                        .args = std::move(args)};
+}
+
+// Combines the hash of the target's shared flags with the command's own args
+auto get_flags_hash(std::size_t common_hash, const CompileCommand& command) {
+  auto hash = common_hash;
+  boost::hash_combine(
+      hash, boost::hash_range(command.args.begin(), command.args.end()));
+  return hash;
+}
+
+// Arguments are quoted so clang reads them back verbatim
+auto write_response_file(const fs::path& path,
+                         const std::vector<std::string>& args) {
+  std::string contents;
+  for (const auto& arg : args) {
+    contents += '"';
+    for (const auto c : arg) {
+      if (c == '"' || c == '\\') contents += '\\';
+      contents += c;
+    }
+    contents += "\"\n";
+  }
 
-  return CompileCommand{.out_file = out, .compiler = kCompiler, .args = args};
+  std::ifstream in(path);
+  std::stringstream ss;
+  ss << in.rdbuf();
+  if (in && ss.str() == contents) return;
+
+  std::ofstream out(path);
+  out << contents;
 }
 
 auto get_prebuilt_module_path(const std::vector<fs::path> sources) {
@@ -95,7 +191,10 @@ auto get_prebuilt_module_path(const std::vector<fs::path> sources) {
          r::to<std::set>();
 }
 
-auto check_ts(const fs::path& original_path, const fs::path& build_path) {
+// The .ts file records the source timestamp and a hash of the flags the
+// output was built with, so changing the profile or its flags rebuilds it
+auto check_ts(const fs::path& original_path, const fs::path& build_path,
+              std::size_t flags_hash) {
   // The epoch of last_time_write is the year 2174, which means the timestamp is
   // most likely to be negative.
   // https://stackoverflow.com/questions/67142013/why-time-since-epoch-from-a-stdfilesystemfile-time-type-is-negative
@@ -113,23 +212,22 @@ auto check_ts(const fs::path& original_path, const fs::path& build_path) {
   const auto original_ts =
       fs::last_write_time(original_path).time_since_epoch();
 
-  std::fstream f(ts_file);
-  std::stringstream ss;
-  ss << f.rdbuf();
+  std::ifstream f(ts_file);
+  decltype(original_ts.count()) out_ts = 0;
+  std::size_t out_hash = 0;
+  if (!(f >> out_ts >> out_hash)) return true;
 
-  const auto out_ts = std::stol(
-      ss.str().empty() ? std::to_string(original_ts.min().count()) : ss.str());
-
-  return original_ts.count() > out_ts;
+  return original_ts.count() > out_ts || out_hash != flags_hash;
 }
 
-auto update_ts(const fs::path& original_path, const fs::path& build_path) {
+auto update_ts(const fs::path& original_path, const fs::path& build_path,
+               std::size_t flags_hash) {
   const auto new_ts =
       fs::last_write_time(original_path).time_since_epoch().count();
 
   const auto ts_file = fs::path(build_path.string() + ".ts");
   std::ofstream f(ts_file);
-  f << new_ts;
+  f << new_ts << ' ' << flags_hash;
 }
 
 auto link_object(const std::vector<fs::path>& objs, const std::string& cmd,
@@ -153,131 +251,196 @@ export auto get_target_compile_args(const config::BuildTarget& target) {
          rv::join | r::to<std::vector>();
 }
 
+// With ThinLTO the objects are bitcode and lld runs the optimisation pipeline
+// at the -O level the driver forwards, the last one wins as for the compiles
+auto get_profile_link_args(const fs::path& build_root,
+                           const config::BuildProfile& profile,
+                           const std::vector<std::string>& compile_args,
+                           std::size_t jobs) {
+  std::vector<std::string> args;
+  if (!profile.thin_lto) return args;
+
+  std::optional<std::string> opt_level;
+  for (const auto& arg : compile_args) {
+    if (arg.starts_with("-O")) opt_level = arg;
+  }
+  if (opt_level.has_value()) args.push_back(opt_level.value());
+
+  args.insert(args.end(),
+              {
+                  "-flto=thin",
+                  "-fuse-ld=lld",
+                  std::format("-Wl,--thinlto-jobs={}", jobs),
+                  std::format("-Wl,--thinlto-cache-dir={}",
+                              build_root / "thinlto_cache"),
+              });
+
+  return args;
+}
+
+// The scanner's edges point from a source to the sources it imports, so each
+// edge is a dependency of its source vertex
+auto make_dag(const scanner::graph_t& graph) {
+  std::vector<fs::path> sources;
+  std::map<scanner::graph_t::vertex_descriptor, std::size_t> index;
+  for (const auto v : boost::make_iterator_range(boost::vertices(graph))) {
+    index.emplace(v, sources.size());
+    sources.push_back(graph[v]);
+  }
+
+  scheduler::Dag dag(sources.size());
+  for (const auto e : boost::make_iterator_range(boost::edges(graph))) {
+    dag.add_edge(index.at(boost::source(e, graph)),
+                 index.at(boost::target(e, graph)));
+  }
+
+  return std::pair{dag, sources};
+}
+
 export auto build_target(const scanner::graph_t& graph, const fs::path& root,
                          const fs::path& build_root,
-                         const config::BuildTarget& target) {
+                         const config::BuildProfile& profile,
+                         const config::BuildTarget& target, std::size_t jobs,
+                         bool time_trace) {
   if (boost::num_vertices(graph) == 0) return;
 
-  const auto compile_args = get_target_compile_args(target);
   const auto module_paths = get_prebuilt_module_path(target.sources);
 
+  // Resolved once rather than searching PATH for every spawn
+  const auto compiler = buildr::proc::find_executable(kCompiler);
+  if (compiler.empty()) {
+    log::error("Failed to find compiler: {}", kCompiler);
+    std::exit(1);
+  }
+
+  // The target's flags (including the pkgconf ones) are written once and
+  // every compile command references them with @file
+  const auto rsp_file = build_root / std::format("{}.rsp", target.name);
+  const auto common_args = get_common_args(build_root, profile, module_paths,
+                                           get_target_compile_args(target));
+  write_response_file(rsp_file, *common_args);
+  const auto common_hash =
+      std::hash<std::string>{}(boost::algorithm::join(*common_args, "\n"));
+  const auto rsp_args = std::make_shared<const std::vector<std::string>>(
+      std::vector{std::format("@{}", rsp_file)});
+
   boost::asio::io_context ctx;
-  const auto task_runner = [&ctx, root, build_root, compile_args,
-                            module_paths](fs::path src)
+  const auto task_runner = [&](const fs::path& src)
       -> std::expected<std::pair<fs::path, bool>, std::string> {
-    const auto& command =
-        get_compile_command(root, build_root, module_paths, src, compile_args);
+    auto command =
+        get_compile_command(root, build_root, profile, rsp_args, src);
+    const auto flags_hash = get_flags_hash(common_hash, command);
 
     const auto& out = command.out_file;
 
     const auto& src_abs = root / src;
     const auto& out_abs = root / out;
+    const auto trace_abs = root / get_time_trace_path(out);
+
+    // The default granularity drops events under 500us, which hides headers
+    // that are cheap per TU but included everywhere
+    if (time_trace) {
+      command.args.push_back(std::format("-ftime-trace={}", trace_abs));
+      command.args.emplace_back("-ftime-trace-granularity=0");
+    }
 
     if (!fs::exists(out_abs.parent_path())) {
       fs::create_directories(out_abs.parent_path());
     }
 
-    if (fs::exists(out_abs) && !check_ts(src_abs, out_abs)) {
+    // A report needs a trace that matches the current object
+    std::error_code ec;
+    const bool trace_stale =
+        time_trace && (!fs::exists(trace_abs, ec) ||
+                       (fs::exists(out_abs, ec) &&
+                        fs::last_write_time(trace_abs, ec) <
+                            fs::last_write_time(out_abs, ec)));
+
+    bool built = false;
+    if (fs::exists(out_abs) && !trace_stale &&
+        !check_ts(src_abs, out_abs, flags_hash)) {
       log::debug("skipping: {}", src);
-      return std::pair{out, false};
+    } else {
+      const auto args = command.all_args();
+      log::debug("Compiling: {}\n\targs: {} {}", src, compiler, args);
+
+      const auto res = buildr::proc::spawn_and_wait(compiler, args);
+
+      // The old trace no longer describes this object
+      if (!time_trace) fs::remove(trace_abs, ec);
+
+      if (!res.has_value()) {
+        return std::unexpected(std::format("Failed to compile {}: {}", src,
+                                           res.error().message()));
+      }
+
+      // Only a successful compile may mark the output as up to date
+      update_ts(src_abs, out_abs, flags_hash);
+      built = true;
     }
 
-    log::debug("Compiling: {}\n\targs: {} {}", src, command.compiler,
-               command.args);
+    if (!is_module(src)) return std::pair{out, built};
+
+    // The object is timestamped against its .pcm like any other output
+    const auto obj_command = get_module_object_command(profile, rsp_args, out);
+    const auto obj_hash = get_flags_hash(common_hash, obj_command);
+    const auto& obj = obj_command.out_file;
+    const auto obj_abs = root / obj;
+
+    if (!built && !check_ts(out_abs, obj_abs, obj_hash)) {
+      return std::pair{obj, false};
+    }
 
-    const auto res =
-        buildr::proc::run_process_async(ctx, command.compiler, command.args);
+    const auto args = obj_command.all_args();
+    log::debug("Compiling: {}\n\targs: {} {}", out, compiler, args);
 
-    update_ts(src_abs, out_abs);
+    const auto res = buildr::proc::spawn_and_wait(compiler, args);
     if (!res.has_value()) {
-      log::error("{}", res.error().message());
-      return std::pair{out, false};
+      return std::unexpected(
+          std::format("Failed to compile {}: {}", out, res.error().message()));
     }
 
-    return std::pair{out, true};
+    update_ts(out_abs, obj_abs, obj_hash);
+    return std::pair{obj, true};
   };
 
-  auto compilation_graph = graph;
+  const auto [dag, sources] = make_dag(graph);
 
+  std::mutex objs_mutex;
   bool built_obj = false;
   std::vector<fs::path> compiled_objs;
-  compiled_objs.reserve(boost::num_vertices(compilation_graph));
-
-  boost::asio::thread_pool thread_pool(5);
-
-  // Take a task out of module_sources with 0 out degrees,
-  // and queue the task
-  using vertex_t = scanner::graph_t::vertex_descriptor;
-  std::unordered_set<fs::path> queued;
-
-  std::mutex graph_mutex;
-  const auto& find_next_task = [&compilation_graph, &graph_mutex,
-                                &queued]() -> std::optional<vertex_t> {
-    std::lock_guard l(graph_mutex);
-    for (auto v :
-         boost::make_iterator_range(boost::vertices(compilation_graph))) {
-      if (!queued.contains(compilation_graph[v]) &&
-          boost::out_degree(v, compilation_graph) == 0)
-        return v;
-    }
-
-    return std::nullopt;
-  };
+  compiled_objs.reserve(sources.size());
 
-  const auto& task_completed = [&](const auto& src) {
-    std::lock_guard l(graph_mutex);
-    queued.erase(src);
-    for (const auto& v :
-         boost::make_iterator_range(boost::vertices(compilation_graph))) {
-      if (compilation_graph[v] == src) {
-        boost::clear_vertex(v, compilation_graph);
-        boost::remove_vertex(v, compilation_graph);
-        return;
-      }
+  scheduler::ThreadPoolExecutor executor(jobs, [&](std::size_t task) {
+    const auto& result = task_runner(sources[task]);
+    if (!result.has_value()) {
+      log::error("{}", result.error());
+      return false;
     }
-  };
 
-  std::condition_variable cond;
-  std::optional<std::string> error;
-  while ((boost::num_vertices(compilation_graph) > 0 || !queued.empty()) &&
-         !error.has_value()) {
-    ansi::reset_line();
-    log::info("tasks: {}, queued: {}", boost::num_vertices(compilation_graph),
-              queued | r::to<std::vector>());
-
-    std::optional<vertex_t> vertex = find_next_task();
-    if (!vertex.has_value()) {
-      // No tasks available wait for one to finish
-      std::unique_lock l(graph_mutex);
-      cond.wait_for(l, 5s);  // Wake up just in case
-      continue;
-    }
+    const auto [out, built] = result.value();
+    std::lock_guard l(objs_mutex);
+    built_obj = built_obj || built;
+    compiled_objs.push_back(out);
+    return true;
+  });
 
-    std::lock_guard l(graph_mutex);
-    const auto src = compilation_graph[vertex.value()];
-    queued.emplace(src);
-
-    boost::asio::post(thread_pool, [&, src]() {
-      const auto& result = task_runner(src);
-      task_completed(src);
-
-      if (!result.has_value()) {
-        error = result.error();
-      } else {
-        const auto [out, built] = result.value();
-        std::lock_guard l(graph_mutex);
-        built_obj = built;
-        compiled_objs.push_back(out);
-      }
+  const auto result = scheduler::schedule(
+      dag, executor, [](std::size_t remaining, std::size_t running) {
+        ansi::reset_line();
+        log::info("tasks: {}, running: {}", remaining, running);
+      });
 
-      cond.notify_all();
-    });
+  if (result.failed) {
+    log::error("Build failed");
+    std::exit(1);
   }
 
-  ansi::reset_line();
-  log::info("All tasks queued");
-
-  thread_pool.wait();
+  if (result.stalled(dag)) {
+    log::error("Dependency cycle, {} task(s) never became ready",
+               dag.size() - result.completed);
+    std::exit(1);
+  }
 
   ansi::reset_line();
   log::info("All tasks completed");
@@ -286,19 +449,13 @@ export auto build_target(const scanner::graph_t& graph, const fs::path& root,
       std::vector{target.link_args, deps::get_link_args(target.dependencies)} |
       rv::join | r::to<std::vector>();
 
-  const auto m_paths =
-      module_paths | rv::transform([build_root](const auto& p) {
-        return std::format("-fprebuilt-module-path={}", build_root / p);
-      }) |
-      r::to<std::vector>();
-
   const auto args =
       std::vector{
           compiled_objs | rv::transform([](const auto& path) {
             return path.string();
           }) | r::to<std::vector>(),
           link_args,
-          m_paths,
+          get_profile_link_args(build_root, profile, *common_args, jobs),
           {
               "-o",
               (build_root / target.name).string(),
@@ -306,19 +463,21 @@ export auto build_target(const scanner::graph_t& graph, const fs::path& root,
       } |
       rv::join | r::to<std::vector>();
 
-  if (built_obj) {
+  // A previous link may have failed after all objects were built
+  if (built_obj || !fs::exists(build_root / target.name)) {
     log::info("Linking: {}", target.name);
-    log::debug("{} {}", kCompiler, boost::algorithm::join(args, " "));
-    auto proc = buildr::proc::run_process(ctx, kCompiler, args);
+    log::debug("{} {}", compiler, boost::algorithm::join(args, " "));
+    auto proc = buildr::proc::run_process(ctx, compiler, args);
 
     boost::system::error_code ec;
     const auto ret = proc.wait(ec);
     if (ret != 0) {
-      log::error("{}", proc.stderr());
-    } else {
-      ansi::reset_line();
-      log::info("Linked");
+      log::error("Link failed: {}", proc.stderr());
+      std::exit(1);
     }
+
+    ansi::reset_line();
+    log::info("Linked");
   }
 
   log::info("Finished");
@@ -335,22 +494,27 @@ BOOST_DESCRIBE_STRUCT(CompileCommandsEntry, (),
 
 export auto generate_compile_commands(
     const fs::path& root, const fs::path& build_root,
+    const config::BuildProfile& profile,
     const std::vector<std::string>& compiler_args,
     const std::vector<fs::path>& sources) {
   toml::array compile_commands;
 
-  const auto module_paths = get_prebuilt_module_path(sources);
+  // Tools reading the database get the flags inline rather than the @file
+  const auto common_args =
+      get_common_args(build_root, profile, get_prebuilt_module_path(sources),
+                      compiler_args);
 
   for (const auto& src : sources) {
-    const auto [out, compiler, args] = builder::get_compile_command(
-        root, build_root, module_paths, src, compiler_args);
+    const auto command = builder::get_compile_command(root, build_root, profile,
+                                                      common_args, src);
 
     const auto b_out = builder::get_build_path(root, build_root, src);
 
     compile_commands.push_back(toml::table{
         {"directory", root.string()},
-        {"command",
-         std::format("{} {}", compiler, boost::algorithm::join(args, " "))},
+        {"command", std::format("{} {}", command.compiler,
+                                boost::algorithm::join(command.all_args(),
+                                                       " "))},
         {"file", src.string()},
         {"output", b_out.string()},
     });
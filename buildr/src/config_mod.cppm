@@ -2,6 +2,7 @@ module;
 
 #include <boost/describe.hpp>
 #include <filesystem>
+#include <optional>
 #include <ranges>
 #include <string>
 #include <vector>
@@ -12,6 +13,7 @@ module;
 export module config_mod;
 
 import logging;
+import glob_mod;
 
 namespace config {
 
@@ -43,13 +45,47 @@ export struct BuildTarget {
 BOOST_DESCRIBE_STRUCT(BuildTarget, (),
                       (target_type, name, sources, compile_args, link_args));
 
+export struct BuildProfile {
+  std::string name;
+  std::vector<std::string> compile_args;
+  bool debug_info = false;
+  bool thin_lto = false;
+};
+BOOST_DESCRIBE_STRUCT(BuildProfile, (),
+                      (name, compile_args, debug_info, thin_lto));
+
+export auto get_profile(std::string_view name) -> std::optional<BuildProfile> {
+  if (name == "debug")
+    return BuildProfile{
+        .name = "debug", .compile_args = {"-O0"}, .debug_info = true};
+
+  if (name == "release")
+    return BuildProfile{.name = "release",
+                        .compile_args = {"-O3", "-DNDEBUG"},
+                        .thin_lto = true};
+
+  if (name == "relwithdebinfo")
+    return BuildProfile{.name = "relwithdebinfo",
+                        .compile_args = {"-O2", "-DNDEBUG"},
+                        .debug_info = true};
+
+  return std::nullopt;
+}
+
 export struct ProjectConfig {
   fs::path root_dir;
   fs::path build_dir;
+
+  // Each profile builds into its own subdirectory of build_dir so switching
+  // between them doesn't invalidate the others
+  BuildProfile profile;
+  fs::path profile_dir;
+
   std::vector<BuildTarget> targets;
 };
 
-BOOST_DESCRIBE_STRUCT(ProjectConfig, (), (root_dir, build_dir, targets));
+BOOST_DESCRIBE_STRUCT(ProjectConfig, (),
+                      (root_dir, build_dir, profile, profile_dir, targets));
 
 auto get_toml_array_string(const toml::array& array) {
   return rv::all(array) |
@@ -61,12 +97,21 @@ auto get_toml_array_string(const toml::array& array) {
          r::to<std::vector>();
 }
 
-export auto parse_project(const fs::path& dir) {
+export auto parse_project(const fs::path& dir, const std::string& profile) {
   ProjectConfig config;
 
   config.root_dir = dir;
   config.build_dir = dir / "build";
 
+  const auto build_profile = get_profile(profile);
+  if (!build_profile.has_value()) {
+    log::error("Unknown profile: {}", profile);
+    std::exit(1);
+  }
+
+  config.profile = build_profile.value();
+  config.profile_dir = config.build_dir / config.profile.name;
+
   BuildTarget default_target{};
 
   const auto result = toml::parse_file((dir / "buildr.toml").string());
@@ -77,6 +122,11 @@ export auto parse_project(const fs::path& dir) {
 
   const auto& tbl = result.table();
 
+  if (const auto* overrides = tbl["profile"][profile].as_table()) {
+    if (const auto lto = (*overrides)["lto"].value<bool>())
+      config.profile.thin_lto = lto.value();
+  }
+
   default_target.name = dir.stem().string();
 
   if (tbl.contains("compile_args"))
@@ -87,28 +137,24 @@ export auto parse_project(const fs::path& dir) {
     default_target.link_args =
         get_toml_array_string(*tbl["link_args"].as_array());
 
+  // Entries may be glob patterns (src/**/*.cppm), those starting with '!' are
+  // excludes
+  globber::Globber expander(config.root_dir, config.build_dir);
+
   if (tbl.contains("include_dirs")) {
     default_target.include_dirs =
-        rv::all(*tbl["include_dirs"].as_array()) |
-        rv::transform([](const auto& node) -> std::optional<fs::path> {
-          return node.template value<std::string>();
-        }) |
-        rv::filter([](const auto& opt) { return opt.has_value(); }) |
-        rv::transform([](const auto& opt) { return opt.value(); }) |
-        r::to<std::vector>();
+        expander.expand(get_toml_array_string(*tbl["include_dirs"].as_array()),
+                        globber::EntryType::Directory);
   }
 
   if (tbl.contains("srcs")) {
     default_target.sources =
-        rv::all(*tbl["srcs"].as_array()) |
-        rv::transform([](const auto& node) -> std::optional<fs::path> {
-          return node.template value<std::string>();
-        }) |
-        rv::filter([](const auto& opt) { return opt.has_value(); }) |
-        rv::transform([](const auto& opt) { return opt.value(); }) |
-        r::to<std::vector>();
+        expander.expand(get_toml_array_string(*tbl["srcs"].as_array()),
+                        globber::EntryType::File);
   }
 
+  expander.save();
+
   if (tbl.contains("dependencies")) {
     for (const auto& [key, val] : *tbl["dependencies"].as_table()) {
       Dependency dep{.name = std::string(key.str())};
@@ -0,0 +1,449 @@
+module;
+
+#include <boost/asio.hpp>
+#include <boost/describe.hpp>
+#include <boost/json.hpp>
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <ranges>
+#include <set>
+#include <span>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "format.hpp"
+
+export module glob_mod;
+
+import logging;
+
+namespace globber {
+
+namespace fs = std::filesystem;
+namespace r = std::ranges;
+namespace rv = r::views;
+
+// Cached contents of a single directory, only valid while the directory's
+// mtime is unchanged. Adding, removing or renaming an entry bumps the mtime of
+// the containing directory only, so each directory is checked on its own.
+struct DirListing {
+  std::int64_t mtime = 0;
+  std::vector<std::string> files;
+  std::vector<std::string> dirs;
+  // Symlinked directories are matched as directories but never walked into,
+  // they can form cycles
+  std::vector<std::string> linked_dirs;
+};
+BOOST_DESCRIBE_STRUCT(DirListing, (), (mtime, files, dirs, linked_dirs));
+
+using cache_t = std::map<std::string, DirListing>;
+
+export enum class EntryType { File, Directory };
+
+export auto is_glob(std::string_view entry) {
+  return entry.starts_with('!') ||
+         entry.find_first_of("*?[") != std::string_view::npos;
+}
+
+auto split(const fs::path& p) {
+  return p.lexically_normal() |
+         rv::transform([](const auto& s) { return s.string(); }) |
+         rv::filter([](const auto& s) { return !s.empty() && s != "."; }) |
+         r::to<std::vector>();
+}
+
+// Matches a single wildcard token at pattern[p], returning the index just past
+// the token on success.
+auto match_char(std::string_view pattern, std::size_t p, char c)
+    -> std::optional<std::size_t> {
+  if (pattern[p] == '?') return p + 1;
+
+  if (pattern[p] == '[') {
+    auto i = p + 1;
+    const bool negate =
+        i < pattern.size() && (pattern[i] == '!' || pattern[i] == '^');
+    if (negate) ++i;
+
+    const auto first = i;
+    bool matched = false;
+    while (i < pattern.size() && (pattern[i] != ']' || i == first)) {
+      if (i + 2 < pattern.size() && pattern[i + 1] == '-' &&
+          pattern[i + 2] != ']') {
+        matched = matched || (pattern[i] <= c && c <= pattern[i + 2]);
+        i += 3;
+      } else {
+        matched = matched || pattern[i] == c;
+        ++i;
+      }
+    }
+
+    // Unterminated class, treat the bracket as a literal
+    if (i >= pattern.size())
+      return c == '[' ? std::optional{p + 1} : std::nullopt;
+
+    return matched != negate ? std::optional{i + 1} : std::nullopt;
+  }
+
+  return pattern[p] == c ? std::optional{p + 1} : std::nullopt;
+}
+
+auto match_segment(std::string_view pattern, std::string_view name) {
+  // Like the shell, wildcards don't match hidden entries
+  if (name.starts_with('.') && !pattern.starts_with('.')) return false;
+
+  std::size_t p = 0;
+  std::size_t n = 0;
+  std::optional<std::pair<std::size_t, std::size_t>> star;
+
+  while (n < name.size()) {
+    if (p < pattern.size() && pattern[p] == '*') {
+      star = {++p, n};
+      continue;
+    }
+
+    if (p < pattern.size()) {
+      if (const auto next = match_char(pattern, p, name[n])) {
+        p = next.value();
+        ++n;
+        continue;
+      }
+    }
+
+    if (!star.has_value()) return false;
+    p = star->first;
+    n = ++star->second;
+  }
+
+  while (p < pattern.size() && pattern[p] == '*') ++p;
+  return p == pattern.size();
+}
+
+auto match_path(std::span<const std::string> pattern,
+                std::span<const std::string> path) -> bool {
+  if (pattern.empty()) return path.empty();
+
+  if (pattern.front() == "**") {
+    for (std::size_t i = 0; i <= path.size(); ++i) {
+      if (match_path(pattern.subspan(1), path.subspan(i))) return true;
+      if (i < path.size() && path[i].starts_with('.')) return false;
+    }
+    return false;
+  }
+
+  if (path.empty() || !match_segment(pattern.front(), path.front()))
+    return false;
+
+  return match_path(pattern.subspan(1), path.subspan(1));
+}
+
+struct Pattern {
+  std::vector<std::string> segments;
+  bool exclude = false;
+
+  explicit Pattern(std::string_view entry)
+      : segments(split(std::string(entry.starts_with('!') ? entry.substr(1)
+                                                          : entry))),
+        exclude(entry.starts_with('!')) {}
+
+  // Directory to start walking from, the longest prefix without wildcards
+  [[nodiscard]] auto base() const {
+    fs::path b;
+    for (const auto& s : segments | rv::take(segments.size() - 1)) {
+      if (is_glob(s)) break;
+      b /= s;
+    }
+    return b;
+  }
+
+  // How many levels below base() can match, nullopt when the pattern
+  // contains '**'
+  [[nodiscard]] auto max_depth() const -> std::optional<std::size_t> {
+    if (r::contains(segments, "**")) return std::nullopt;
+    return segments.size() - split(base()).size();
+  }
+
+  [[nodiscard]] auto matches(const fs::path& p) const {
+    return match_path(segments, split(p));
+  }
+
+  // An exclude ending in '**' drops the whole subtree, so there is no need to
+  // walk into it
+  [[nodiscard]] auto prunes(const fs::path& dir) const {
+    return exclude && !segments.empty() && segments.back() == "**" &&
+           match_path(segments, split(dir));
+  }
+};
+
+struct Entry {
+  fs::path path;
+  EntryType type;
+};
+
+// Walks a directory tree on a thread pool, re-listing only the directories
+// whose mtime changed since the cached listing. Listings made earlier in the
+// same run are reused as is, so overlapping patterns only pay for a walk.
+class Walker {
+ public:
+  Walker(const fs::path& root, const fs::path& build_root, const cache_t& cache,
+         const std::vector<Pattern>& excludes, cache_t& new_cache,
+         std::mutex& cache_mutex)
+      : root_(root),
+        build_dir_(build_root.lexically_relative(root)),
+        cache_(cache),
+        excludes_(excludes),
+        new_cache_(new_cache),
+        cache_mutex_(cache_mutex) {}
+
+  auto walk(const fs::path& base, std::optional<std::size_t> max_depth) {
+    boost::asio::thread_pool pool(
+        std::max(1U, std::thread::hardware_concurrency()));
+    visit(pool, base, 0, max_depth);
+    pool.wait();
+
+    return std::move(entries_);
+  }
+
+  [[nodiscard]] auto listed() const { return listed_.load(); }
+  [[nodiscard]] auto cached() const { return cached_.load(); }
+
+ private:
+  auto list(const fs::path& rel) -> std::optional<DirListing> {
+    const auto key = rel.generic_string();
+
+    {
+      std::lock_guard l(cache_mutex_);
+      if (const auto it = new_cache_.find(key); it != new_cache_.end()) {
+        ++cached_;
+        return it->second;
+      }
+    }
+
+    std::error_code ec;
+    const auto mtime =
+        fs::last_write_time(root_ / rel, ec).time_since_epoch().count();
+    if (ec) return std::nullopt;
+
+    if (const auto it = cache_.find(key);
+        it != cache_.end() && it->second.mtime == mtime) {
+      ++cached_;
+      return it->second;
+    }
+
+    ++listed_;
+    DirListing listing{.mtime = mtime};
+    // Runs on the thread pool, so nothing here may throw. The directory can
+    // be removed or become unreadable while it is being listed.
+    for (fs::directory_iterator it(root_ / rel, ec), end; !ec && it != end;
+         it.increment(ec)) {
+      const auto name = it->path().filename().string();
+
+      // Dangling symlinks have no target to classify, skip them
+      std::error_code status_ec;
+      const auto status = it->status(status_ec);
+      if (status_ec) continue;
+
+      if (!fs::is_directory(status))
+        listing.files.push_back(name);
+      else if (it->is_symlink(status_ec))
+        listing.linked_dirs.push_back(name);
+      else
+        listing.dirs.push_back(name);
+    }
+    if (ec) return std::nullopt;
+
+    r::sort(listing.files);
+    r::sort(listing.dirs);
+    r::sort(listing.linked_dirs);
+    return listing;
+  }
+
+  void visit(boost::asio::thread_pool& pool, const fs::path& rel,
+             std::size_t depth, std::optional<std::size_t> max_depth) {
+    const auto listing = list(rel);
+    if (!listing.has_value()) return;
+
+    {
+      std::lock_guard l(cache_mutex_);
+      new_cache_.insert_or_assign(rel.generic_string(), listing.value());
+    }
+
+    std::vector<fs::path> subdirs;
+    {
+      std::lock_guard l(entries_mutex_);
+      for (const auto& f : listing->files)
+        entries_.push_back({.path = rel / f, .type = EntryType::File});
+
+      for (const auto& d : listing->linked_dirs)
+        entries_.push_back({.path = rel / d, .type = EntryType::Directory});
+
+      for (const auto& d : listing->dirs) {
+        const auto p = rel / d;
+        entries_.push_back({.path = p, .type = EntryType::Directory});
+
+        if (d.starts_with('.')) continue;
+        if (p.lexically_normal() == build_dir_) continue;
+        if (r::any_of(excludes_, [&](const auto& e) { return e.prunes(p); }))
+          continue;
+
+        subdirs.push_back(p);
+      }
+    }
+
+    if (max_depth.has_value() && depth + 1 >= max_depth.value()) return;
+
+    for (auto& p : subdirs) {
+      boost::asio::post(pool, [this, &pool, p = std::move(p), depth,
+                               max_depth]() {
+        visit(pool, p, depth + 1, max_depth);
+      });
+    }
+  }
+
+  fs::path root_;
+  fs::path build_dir_;
+  const cache_t& cache_;
+  const std::vector<Pattern>& excludes_;
+
+  cache_t& new_cache_;
+  std::mutex& cache_mutex_;
+
+  std::mutex entries_mutex_;
+  std::vector<Entry> entries_;
+
+  std::atomic<std::size_t> listed_ = 0;
+  std::atomic<std::size_t> cached_ = 0;
+};
+
+// Expands glob patterns in buildr.toml entries. Directory listings are cached
+// in the build directory and keyed on their mtime so that a no-op build only
+// has to stat each directory rather than re-list the whole tree.
+export class Globber {
+ public:
+  Globber(fs::path root, fs::path build_root)
+      : root_(std::move(root)), build_root_(std::move(build_root)) {}
+
+  auto expand(const std::vector<std::string>& entries, EntryType type)
+      -> std::vector<fs::path> {
+    if (!r::any_of(entries, is_glob)) {
+      return entries |
+             rv::transform([](const auto& e) { return fs::path(e); }) |
+             r::to<std::vector>();
+    }
+
+    load_cache();
+
+    const auto excludes = entries | rv::filter([](const auto& e) {
+                            return e.starts_with('!');
+                          }) |
+                          rv::transform([](const auto& e) {
+                            return Pattern(e);
+                          }) |
+                          r::to<std::vector>();
+
+    const auto excluded = [&](const fs::path& p) {
+      return r::any_of(excludes, [&](const auto& e) { return e.matches(p); });
+    };
+
+    std::vector<fs::path> expanded;
+    std::set<fs::path> seen;
+    for (const auto& entry : entries) {
+      if (entry.starts_with('!')) continue;
+
+      if (!is_glob(entry)) {
+        if (seen.emplace(entry).second) expanded.emplace_back(entry);
+        continue;
+      }
+
+      const Pattern pattern(entry);
+      Walker walker(root_, build_root_, cache_, excludes, new_cache_,
+                    cache_mutex_);
+      auto matched =
+          walker.walk(pattern.base(), pattern.max_depth()) |
+          rv::filter([&](const auto& e) {
+            return e.type == type && pattern.matches(e.path) &&
+                   !excluded(e.path);
+          }) |
+          rv::transform([](const auto& e) { return e.path; }) |
+          r::to<std::vector>();
+      r::sort(matched);
+
+      log::debug("glob: {} matched {} ({} dirs listed, {} cached)", entry,
+                 matched.size(), walker.listed(), walker.cached());
+
+      if (matched.empty()) log::warn("glob: {} didn't match anything", entry);
+
+      dirty_ = dirty_ || walker.listed() > 0;
+
+      for (auto& m : matched) {
+        if (seen.emplace(m).second) expanded.push_back(std::move(m));
+      }
+    }
+
+    return expanded;
+  }
+
+  // Only writes the cache when a directory was re-listed or the set of
+  // directories visited changed, a no-op build doesn't touch it
+  void save() {
+    if (!loaded_) return;
+    if (!dirty_ && r::equal(cache_ | rv::keys, new_cache_ | rv::keys)) return;
+
+    std::error_code ec;
+    fs::create_directories(build_root_, ec);
+
+    std::ofstream f(cache_file());
+    f << boost::json::serialize(boost::json::value_from(new_cache_));
+  }
+
+ private:
+  [[nodiscard]] auto cache_file() const {
+    return build_root_ / "glob_cache.json";
+  }
+
+  void load_cache() {
+    if (loaded_) return;
+    loaded_ = true;
+
+    std::ifstream f(cache_file());
+    if (!f) return;
+
+    std::stringstream ss;
+    ss << f.rdbuf();
+
+    boost::system::error_code ec;
+    const auto json = boost::json::parse(ss.str(), ec);
+    if (ec) {
+      log::warn("Discarding invalid glob cache: {}", ec.message());
+      return;
+    }
+
+    const auto cache = boost::json::try_value_to<cache_t>(json);
+    if (!cache) {
+      log::warn("Discarding invalid glob cache: {}", cache.error().message());
+      return;
+    }
+
+    cache_ = cache.value();
+  }
+
+  fs::path root_;
+  fs::path build_root_;
+
+  bool loaded_ = false;
+  bool dirty_ = false;
+
+  cache_t cache_;
+
+  std::mutex cache_mutex_;
+  cache_t new_cache_;
+};
+
+}  // namespace globber
@@ -1,7 +1,10 @@
 #include <boost/describe.hpp>
 #include <boost/json.hpp>
 #include <boost/program_options.hpp>
+#include <cstdint>
 #include <filesystem>
+#include <ranges>
+#include <thread>
 #include <toml++/toml.hpp>
 
 #include "format.hpp"
@@ -11,17 +14,24 @@ import config_mod;
 import build_mod;
 import dependencies_mod;
 import scan_deps;
+import sim_mod;
+import time_report;
 
 namespace fs = std::filesystem;
+namespace r = std::ranges;
+namespace rv = r::views;
 
 // NOLINTNEXTLINE
-BOOST_DEFINE_ENUM_CLASS(Subcommand, unknown, help, build, clean, run, test);
+BOOST_DEFINE_ENUM_CLASS(Subcommand, unknown, help, build, clean, run, test,
+                        bench);
 
 void print_help(const boost::program_options ::options_description& desc);
-void build(const config::ProjectConfig& project_config);
+void build(const config::ProjectConfig& project_config, std::size_t jobs,
+           bool time_report);
 void clean(const config::ProjectConfig& project_config);
 void run();
 void test();
+auto bench(const boost::program_options::variables_map& vm) -> int;
 
 auto main(int argc, char** argv) -> int {
   namespace po = boost::program_options;
@@ -29,6 +39,22 @@ auto main(int argc, char** argv) -> int {
   po::options_description opts("options");
   opts.add_options()("help", "Show help screen")(
       "directory,C", po::value<fs::path>(), "Working directory to use")(
+      "profile", po::value<std::string>()->default_value("debug"),
+      "Build profile (debug, release, relwithdebinfo)")(
+      "jobs,j",
+      po::value<std::size_t>()->default_value(
+          std::max(1U, std::thread::hardware_concurrency())),
+      "Number of parallel jobs")(
+      "time-report",
+      "Report compile time hotspots from clang's -ftime-trace output")(
+      "nodes", po::value<std::size_t>()->default_value(100'000),
+      "bench: number of tasks in the synthetic graph")(
+      "seed", po::value<std::uint64_t>()->default_value(1),
+      "bench: random seed")(
+      "fail-rate", po::value<double>()->default_value(0.0),
+      "bench: probability of a task failing")(
+      "stress", po::value<std::size_t>(),
+      "bench: check the scheduler on this many random graphs")(
       "command", po::value<std::string>(), "command to execute");
 
   po::positional_options_description pos;
@@ -44,6 +70,11 @@ auto main(int argc, char** argv) -> int {
   po::store(parsed, vm);
   po::notify(vm);
 
+  if (vm.at("jobs").as<std::size_t>() == 0) {
+    log::error("--jobs must be at least 1");
+    return EXIT_FAILURE;
+  }
+
   Subcommand subcommand = Subcommand::help;
   if (vm.contains("command"))
     boost::describe::enum_from_string(vm.at("command").as<std::string>(),
@@ -53,7 +84,11 @@ auto main(int argc, char** argv) -> int {
                                    ? vm.at("directory").as<fs::path>()
                                    : fs::current_path();
 
-  const auto& project_config = config::parse_project(working_directory);
+  // Runs on synthetic graphs, doesn't need a project
+  if (subcommand == Subcommand::bench) return bench(vm);
+
+  const auto& project_config = config::parse_project(
+      working_directory, vm.at("profile").as<std::string>());
 
   switch (subcommand) {
     case Subcommand::unknown:
@@ -62,7 +97,8 @@ auto main(int argc, char** argv) -> int {
       std::exit(1);
       return EXIT_FAILURE;
     case Subcommand::build:
-      build(project_config);
+      build(project_config, vm.at("jobs").as<std::size_t>(),
+            vm.contains("time-report"));
       break;
     case Subcommand::clean:
       clean(project_config);
@@ -73,6 +109,8 @@ auto main(int argc, char** argv) -> int {
     case Subcommand::test:
       test();
       break;
+    case Subcommand::bench:
+      break;
   }
 }
 
@@ -82,11 +120,14 @@ void print_help(const boost::program_options ::options_description& desc) {
   log::info("{}", ss.str());
 }
 
-void build(const config::ProjectConfig& project_config) {
-  fs::create_directory(project_config.build_dir);
+void build(const config::ProjectConfig& project_config, std::size_t jobs,
+           bool time_report) {
+  const auto& build_dir = project_config.profile_dir;
+  fs::create_directories(build_dir);
 
   log::info("Project directory: {}", project_config.root_dir);
-  log::info("Build directory: {}", project_config.build_dir);
+  log::info("Build directory: {}", build_dir);
+  log::info("Profile: {}", project_config.profile.name);
 
   log::debug("{} target(s)", project_config.targets.size());
 
@@ -105,36 +146,69 @@ void build(const config::ProjectConfig& project_config) {
 
   std::vector<std::string> compile_args =
       builder::get_target_compile_args(default_target);
-  builder::generate_compile_commands(project_config.root_dir,
-                                     project_config.build_dir, compile_args,
+  builder::generate_compile_commands(project_config.root_dir, build_dir,
+                                     project_config.profile, compile_args,
                                      default_target.sources);
 
-  auto graph =
-      scanner::build_graph(project_config.root_dir, project_config.build_dir);
+  auto graph = scanner::build_graph(project_config.root_dir, build_dir);
   if (!graph.has_value()) {
     log::error("Failed to generate build graph");
     std::exit(1);
   }
 
   scanner::print_graph(graph.value());
-  builder::build_target(graph.value(), project_config.root_dir,
-                        project_config.build_dir, default_target);
+  builder::build_target(graph.value(), project_config.root_dir, build_dir,
+                        project_config.profile, default_target, jobs,
+                        time_report);
+
+  if (time_report) {
+    const auto traces =
+        default_target.sources | rv::transform([&](const auto& src) {
+          return project_config.root_dir /
+                 builder::get_time_trace_path(builder::get_build_path(
+                     project_config.root_dir, build_dir, src));
+        }) |
+        r::to<std::vector>();
+
+    report::write_time_report(traces, build_dir / "time_report.json");
+  }
 }
 
 void clean(const config::ProjectConfig& project_config) {
-  fs::remove_all(project_config.build_dir);
+  // Only the selected profile is cleaned, the others are left untouched
+  const auto& build_dir = project_config.profile_dir;
+  fs::remove_all(build_dir);
 
   const auto default_target = project_config.targets.front();
   std::vector<std::string> compile_args =
       builder::get_target_compile_args(default_target);
 
-  fs::create_directory(project_config.build_dir);
+  fs::create_directories(build_dir);
 
-  builder::generate_compile_commands(project_config.root_dir,
-                                     project_config.build_dir, compile_args,
+  builder::generate_compile_commands(project_config.root_dir, build_dir,
+                                     project_config.profile, compile_args,
                                      default_target.sources);
 }
 
 void run() {}
 
 void test() {}
+
+auto bench(const boost::program_options::variables_map& vm) -> int {
+  const auto seed = vm.at("seed").as<std::uint64_t>();
+
+  if (vm.contains("stress")) {
+    return sim::run_stress(vm.at("stress").as<std::size_t>(), seed)
+               ? EXIT_SUCCESS
+               : EXIT_FAILURE;
+  }
+
+  const sim::BenchOptions opts{
+      .graph = {.nodes = vm.at("nodes").as<std::size_t>(),
+                .fail_rate = vm.at("fail-rate").as<double>()},
+      .workers = vm.at("jobs").as<std::size_t>(),
+      .seed = seed,
+  };
+
+  return sim::run_benchmark(opts) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -1,8 +1,16 @@
 #include "proc.hpp"
 
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
 #include <boost/process.hpp>
 #include <cassert>
+#include <cerrno>
+#include <cstring>
 #include <expected>
+#include <format>
+#include <system_error>
 
 import logging;
 
@@ -28,11 +36,15 @@ auto Process::stderr() -> std::string {
   return out;
 }
 
+auto find_executable(const std::filesystem::path& cmd)
+    -> std::filesystem::path {
+  if (cmd.is_absolute()) return cmd;
+  return bp::environment::find_executable(cmd.string()).string();
+}
+
 auto run_process(boost::asio::io_context& ctx, const std::filesystem::path& cmd,
                  std::vector<std::string> args) -> Process {
-  const auto exe = cmd.is_absolute()
-                       ? cmd.string()
-                       : bp::environment::find_executable(cmd.string());
+  const auto exe = find_executable(cmd).string();
 
   boost::asio::readable_pipe stdout{ctx};
   boost::asio::readable_pipe stderr{ctx};
@@ -43,25 +55,77 @@ auto run_process(boost::asio::io_context& ctx, const std::filesystem::path& cmd,
       std::move(stdout), std::move(stderr)};
 }
 
-auto run_process_async(boost::asio::io_context& ctx,
-                       const std::filesystem::path& cmd,
-                       std::vector<std::string> args)
-    -> std::expected<void, std::error_code> {
-  const auto exe = cmd.is_absolute()
-                       ? cmd.string()
-                       : bp::environment::find_executable(cmd.string());
+namespace {
 
-  std::pair<bool, bool> got_io;
-  std::mutex m;
-  std::condition_variable cond;
+class ExitCategory : public std::error_category {
+ public:
+  [[nodiscard]] auto name() const noexcept -> const char* override {
+    return "exit";
+  }
 
-  auto proc = bp::process(ctx, exe, args);
+  [[nodiscard]] auto message(int status) const -> std::string override {
+    return std::format("process exited with status {}", status);
+  }
+};
 
-  boost::system::error_code ec;
-  int ret = proc.wait(ec);
-  if (ret != 0) {
-    return std::unexpected(static_cast<std::error_code>(ec));
+class SignalCategory : public std::error_category {
+ public:
+  [[nodiscard]] auto name() const noexcept -> const char* override {
+    return "signal";
+  }
+
+  [[nodiscard]] auto message(int signal) const -> std::string override {
+    return std::format("killed by signal {} ({})", signal, strsignal(signal));
   }
+};
+
+auto exit_category() -> const std::error_category& {
+  static const ExitCategory category;
+  return category;
+}
+
+auto signal_category() -> const std::error_category& {
+  static const SignalCategory category;
+  return category;
+}
+
+}  // namespace
+
+auto spawn_and_wait(const std::filesystem::path& exe,
+                    const std::vector<std::string>& args)
+    -> std::expected<void, std::error_code> {
+  const auto exe_str = exe.string();
+
+  // posix_spawn doesn't modify argv, it's only declared non-const for C
+  std::vector<char*> argv;
+  argv.reserve(args.size() + 2);
+  argv.push_back(const_cast<char*>(exe_str.c_str()));
+  for (const auto& arg : args) argv.push_back(const_cast<char*>(arg.c_str()));
+  argv.push_back(nullptr);
+
+  // glibc and musl implement posix_spawn with a vfork style clone, so unlike
+  // fork the parent's address space isn't copied, which keeps spawning cheap
+  // from a large, multithreaded process
+  pid_t pid = 0;
+  if (const auto err = posix_spawn(&pid, exe_str.c_str(), nullptr, nullptr,
+                                   argv.data(), environ);
+      err != 0) {
+    return std::unexpected(std::error_code(err, std::system_category()));
+  }
+
+  int status = 0;
+  while (waitpid(pid, &status, 0) == -1) {
+    if (errno != EINTR)
+      return std::unexpected(std::error_code(errno, std::system_category()));
+  }
+
+  if (WIFSIGNALED(status))
+    return std::unexpected(
+        std::error_code(WTERMSIG(status), signal_category()));
+
+  if (WEXITSTATUS(status) != 0)
+    return std::unexpected(
+        std::error_code(WEXITSTATUS(status), exit_category()));
 
   return {};
 }
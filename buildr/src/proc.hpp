@@ -31,9 +31,14 @@ class Process {
 auto run_process(boost::asio::io_context& ctx, const std::filesystem::path& cmd,
                  std::vector<std::string> args) -> Process;
 
-auto run_process_async(boost::asio::io_context& ctx,
-                       const std::filesystem::path& cmd,
-                       std::vector<std::string> args)
+// Searches PATH for cmd, returns an empty path if it can't be found
+auto find_executable(const std::filesystem::path& cmd)
+    -> std::filesystem::path;
+
+// Runs exe to completion with inherited stdio. exe must be a resolved path,
+// PATH isn't searched.
+auto spawn_and_wait(const std::filesystem::path& exe,
+                    const std::vector<std::string>& args)
     -> std::expected<void, std::error_code>;
 
 }  // namespace buildr::proc
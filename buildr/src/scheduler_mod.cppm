@@ -0,0 +1,170 @@
+module;
+
+#include <boost/asio.hpp>
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+export module scheduler_mod;
+
+import logging;
+
+namespace scheduler {
+
+// Tasks are indices into the graph, an edge means a task can only start once
+// its dependency finished successfully
+export struct Dag {
+  std::vector<std::vector<std::size_t>> dependents;
+  std::vector<std::size_t> dependency_count;
+
+  Dag() = default;
+  explicit Dag(std::size_t size) : dependents(size), dependency_count(size) {}
+
+  [[nodiscard]] auto size() const { return dependents.size(); }
+
+  void add_edge(std::size_t task, std::size_t dependency) {
+    dependents[dependency].push_back(task);
+    dependency_count[task]++;
+  }
+
+  [[nodiscard]] auto dependencies() const {
+    std::vector<std::vector<std::size_t>> deps(size());
+    for (std::size_t d = 0; d < size(); ++d) {
+      for (const auto t : dependents[d]) deps[t].push_back(d);
+    }
+    return deps;
+  }
+};
+
+export struct Completion {
+  std::size_t task;
+  bool ok;
+};
+
+// Runs the tasks handed out by the scheduler, the real one spawns compilers on
+// a thread pool while the simulated one advances a virtual clock
+export class Executor {
+ public:
+  Executor() = default;
+  Executor(const Executor&) = delete;
+  Executor(Executor&&) = delete;
+  auto operator=(const Executor&) -> Executor& = delete;
+  auto operator=(Executor&&) -> Executor& = delete;
+  virtual ~Executor() = default;
+
+  // Maximum number of tasks running at once
+  [[nodiscard]] virtual auto slots() const -> std::size_t = 0;
+
+  virtual void start(std::size_t task) = 0;
+
+  // Blocks until at least one started task finished
+  virtual auto wait() -> std::vector<Completion> = 0;
+};
+
+export struct ScheduleResult {
+  std::size_t completed = 0;
+  bool failed = false;
+
+  // Tasks left that never became ready, the graph has a cycle
+  [[nodiscard]] auto stalled(const Dag& dag) const {
+    return !failed && completed < dag.size();
+  }
+};
+
+using progress_fn = std::function<void(std::size_t, std::size_t)>;
+
+// Hands out tasks as soon as all their dependencies completed. After a
+// failure nothing new is started but running tasks are waited for.
+export auto schedule(const Dag& dag, Executor& executor,
+                     const progress_fn& progress = {}) {
+  auto remaining = dag.dependency_count;
+
+  std::deque<std::size_t> ready;
+  for (std::size_t t = 0; t < dag.size(); ++t) {
+    if (remaining[t] == 0) ready.push_back(t);
+  }
+
+  ScheduleResult result;
+  std::size_t running = 0;
+  while (result.completed < dag.size()) {
+    while (!result.failed && !ready.empty() && running < executor.slots()) {
+      executor.start(ready.front());
+      ready.pop_front();
+      running++;
+    }
+
+    if (running == 0) break;
+
+    for (const auto& [task, ok] : executor.wait()) {
+      running--;
+      result.completed++;
+
+      if (!ok) {
+        result.failed = true;
+        continue;
+      }
+
+      for (const auto d : dag.dependents[task]) {
+        if (--remaining[d] == 0) ready.push_back(d);
+      }
+    }
+
+    if (progress) progress(dag.size() - result.completed, running);
+  }
+
+  return result;
+}
+
+export class ThreadPoolExecutor : public Executor {
+ public:
+  using task_fn = std::function<bool(std::size_t)>;
+
+  ThreadPoolExecutor(std::size_t jobs, task_fn run)
+      : jobs_(std::max<std::size_t>(jobs, 1)),
+        pool_(jobs_),
+        run_(std::move(run)) {}
+
+  ~ThreadPoolExecutor() override { pool_.join(); }
+
+  [[nodiscard]] auto slots() const -> std::size_t override { return jobs_; }
+
+  void start(std::size_t task) override {
+    boost::asio::post(pool_, [this, task]() {
+      bool ok = false;
+      try {
+        ok = run_(task);
+      } catch (const std::exception& e) {
+        log::error("{}", e.what());
+      }
+
+      {
+        std::lock_guard l(mutex_);
+        completed_.push_back({.task = task, .ok = ok});
+      }
+      cond_.notify_one();
+    });
+  }
+
+  auto wait() -> std::vector<Completion> override {
+    std::unique_lock l(mutex_);
+    cond_.wait(l, [this]() { return !completed_.empty(); });
+    return std::exchange(completed_, {});
+  }
+
+ private:
+  std::size_t jobs_;
+  boost::asio::thread_pool pool_;
+  task_fn run_;
+
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  std::vector<Completion> completed_;
+};
+
+}  // namespace scheduler
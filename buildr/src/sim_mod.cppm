@@ -0,0 +1,345 @@
+module;
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <format>
+#include <functional>
+#include <optional>
+#include <print>
+#include <queue>
+#include <random>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+export module sim_mod;
+
+import ansi_mod;
+import logging;
+import scheduler_mod;
+
+namespace sim {
+
+namespace chrono = std::chrono;
+
+// Durations are in virtual microseconds
+export struct SimTask {
+  std::uint64_t duration = 0;
+  bool fail = false;
+};
+
+// Runs fake tasks on a virtual clock. Completions are delivered in order of
+// finish time, ties broken by start order, so a schedule is fully determined
+// by the graph and the task list.
+export class SimulatedExecutor : public scheduler::Executor {
+ public:
+  SimulatedExecutor(const std::vector<SimTask>& tasks, std::size_t workers)
+      : tasks_(tasks),
+        workers_(std::max<std::size_t>(workers, 1)),
+        runs_(tasks.size()),
+        start_(tasks.size()),
+        finish_(tasks.size()) {}
+
+  [[nodiscard]] auto slots() const -> std::size_t override { return workers_; }
+
+  void start(std::size_t task) override {
+    runs_[task]++;
+    start_[task] = now_;
+    running_.push(
+        {.finish = now_ + tasks_[task].duration, .seq = seq_++, .task = task});
+  }
+
+  auto wait() -> std::vector<scheduler::Completion> override {
+    std::vector<scheduler::Completion> done;
+    if (running_.empty()) return done;
+
+    now_ = running_.top().finish;
+    while (!running_.empty() && running_.top().finish == now_) {
+      const auto task = running_.top().task;
+      running_.pop();
+
+      finish_[task] = now_;
+      busy_ += tasks_[task].duration;
+      done.push_back({.task = task, .ok = !tasks_[task].fail});
+    }
+
+    return done;
+  }
+
+  [[nodiscard]] auto now() const { return now_; }
+  [[nodiscard]] auto busy() const { return busy_; }
+  [[nodiscard]] auto idle() const { return (workers_ * now_) - busy_; }
+
+  [[nodiscard]] auto runs(std::size_t task) const { return runs_[task]; }
+  [[nodiscard]] auto start_time(std::size_t task) const { return start_[task]; }
+  [[nodiscard]] auto finish_time(std::size_t task) const {
+    return finish_[task];
+  }
+
+ private:
+  struct Running {
+    std::uint64_t finish;
+    std::uint64_t seq;
+    std::size_t task;
+
+    auto operator>(const Running& o) const {
+      return std::tie(finish, seq) > std::tie(o.finish, o.seq);
+    }
+  };
+
+  const std::vector<SimTask>& tasks_;
+  std::size_t workers_;
+
+  std::uint64_t now_ = 0;
+  std::uint64_t seq_ = 0;
+  std::uint64_t busy_ = 0;
+  std::priority_queue<Running, std::vector<Running>, std::greater<>> running_;
+
+  std::vector<std::size_t> runs_;
+  std::vector<std::uint64_t> start_;
+  std::vector<std::uint64_t> finish_;
+};
+
+export struct GraphOptions {
+  std::size_t nodes = 100'000;
+  // Dependencies are picked among the previous `window` nodes
+  std::size_t window = 1000;
+  std::size_t max_deps = 8;
+  std::uint64_t min_duration = 100;
+  std::uint64_t max_duration = 50'000;
+  double fail_rate = 0;
+};
+
+// Random DAG shaped roughly like a build, nodes only depend on earlier ones
+export auto random_graph(const GraphOptions& opts, std::mt19937_64& rng) {
+  scheduler::Dag dag(opts.nodes);
+  std::vector<SimTask> tasks(opts.nodes);
+
+  std::uniform_int_distribution<std::uint64_t> duration(opts.min_duration,
+                                                        opts.max_duration);
+  std::uniform_int_distribution<std::size_t> deps(0, opts.max_deps);
+  std::bernoulli_distribution fail(opts.fail_rate);
+
+  for (std::size_t t = 0; t < opts.nodes; ++t) {
+    tasks[t] = {.duration = duration(rng), .fail = fail(rng)};
+    if (t == 0) continue;
+
+    const auto first = t > opts.window ? t - opts.window : 0;
+    std::uniform_int_distribution<std::size_t> dep(first, t - 1);
+
+    std::vector<std::size_t> picked;
+    for (auto n = deps(rng); n > 0; --n) picked.push_back(dep(rng));
+    std::ranges::sort(picked);
+    picked.erase(std::ranges::unique(picked).begin(), picked.end());
+
+    for (const auto d : picked) dag.add_edge(t, d);
+  }
+
+  return std::pair{dag, tasks};
+}
+
+// Length of the longest dependency chain, no schedule can beat it
+auto critical_path(const scheduler::Dag& dag, const std::vector<SimTask>& tasks)
+    -> std::uint64_t {
+  auto remaining = dag.dependency_count;
+  std::vector<std::uint64_t> earliest_start(dag.size(), 0);
+
+  std::vector<std::size_t> ready;
+  for (std::size_t t = 0; t < dag.size(); ++t) {
+    if (remaining[t] == 0) ready.push_back(t);
+  }
+
+  std::uint64_t longest = 0;
+  while (!ready.empty()) {
+    const auto t = ready.back();
+    ready.pop_back();
+
+    const auto finish = earliest_start[t] + tasks[t].duration;
+    longest = std::max(longest, finish);
+
+    for (const auto d : dag.dependents[t]) {
+      earliest_start[d] = std::max(earliest_start[d], finish);
+      if (--remaining[d] == 0) ready.push_back(d);
+    }
+  }
+
+  return longest;
+}
+
+export struct BenchOptions {
+  GraphOptions graph;
+  std::size_t workers = 8;
+  std::uint64_t seed = 1;
+};
+
+export auto run_benchmark(const BenchOptions& opts) -> bool {
+  std::mt19937_64 rng(opts.seed);
+  const auto [dag, tasks] = random_graph(opts.graph, rng);
+
+  const auto workers = std::max<std::size_t>(opts.workers, 1);
+
+  log::info("Scheduling {} tasks on {} workers (seed {})", dag.size(), workers,
+            opts.seed);
+
+  SimulatedExecutor sim(tasks, workers);
+  const auto sim_begin = chrono::steady_clock::now();
+  const auto result = scheduler::schedule(dag, sim);
+  const auto sim_wall = chrono::steady_clock::now() - sim_begin;
+
+  // Same graph with no-op tasks, what's left is dispatch and wakeup cost
+  scheduler::ThreadPoolExecutor pool(
+      workers, [&](std::size_t t) { return !tasks[t].fail; });
+  const auto pool_begin = chrono::steady_clock::now();
+  const auto pool_result = scheduler::schedule(dag, pool);
+  const auto pool_wall = chrono::steady_clock::now() - pool_begin;
+
+  std::uint64_t work = 0;
+  for (const auto& t : tasks) work += t.duration;
+
+  const auto path = critical_path(dag, tasks);
+  const auto lower_bound = std::max(path, work / workers);
+
+  const auto per_task = [&](auto wall) {
+    return static_cast<double>(chrono::nanoseconds(wall).count()) /
+           static_cast<double>(std::max<std::size_t>(dag.size(), 1));
+  };
+  const auto ms = [](std::uint64_t us) {
+    return static_cast<double>(us) / 1e3;
+  };
+
+  std::println("\n{}Scheduler benchmark{}", ansi::kBlue, ansi::kReset);
+  std::println("{:<36} {}", "tasks completed", result.completed);
+  std::println("{:<36} {:.1f} ns", "overhead per task (simulated)",
+               per_task(sim_wall));
+  std::println("{:<36} {:.1f} ns", "overhead per task (thread pool)",
+               per_task(pool_wall));
+  std::println("{:<36} {:.1f} ms", "makespan", ms(sim.now()));
+  std::println("{:<36} {:.1f} ms", "critical path", ms(path));
+  std::println("{:<36} {:.1f} ms", "total work / workers",
+               ms(work / workers));
+  std::println(
+      "{:<36} {:.3f}", "makespan / lower bound",
+      static_cast<double>(sim.now()) /
+          static_cast<double>(std::max<std::uint64_t>(lower_bound, 1)));
+  std::println("{:<36} {:.1f} ms ({:.1f}%)", "worker idle time", ms(sim.idle()),
+               100.0 * static_cast<double>(sim.idle()) /
+                   static_cast<double>(
+                       std::max<std::uint64_t>(workers * sim.now(), 1)));
+
+  if (result.failed || pool_result.failed)
+    log::warn("Schedule stopped after an injected failure");
+
+  return !result.stalled(dag) && !pool_result.stalled(dag);
+}
+
+// Every task that ran must have run once, after all of its dependencies
+// finished successfully. Without failures every task must have run.
+auto check_simulated(const scheduler::Dag& dag,
+                     const std::vector<SimTask>& tasks,
+                     const SimulatedExecutor& sim,
+                     const scheduler::ScheduleResult& result)
+    -> std::optional<std::string> {
+  const auto deps = dag.dependencies();
+
+  for (std::size_t t = 0; t < dag.size(); ++t) {
+    if (sim.runs(t) > 1)
+      return std::format("task {} ran {} times", t, sim.runs(t));
+
+    if (sim.runs(t) == 0) {
+      if (!result.failed) return std::format("task {} never ran", t);
+      continue;
+    }
+
+    for (const auto d : deps[t]) {
+      if (sim.runs(d) != 1 || tasks[d].fail ||
+          sim.finish_time(d) > sim.start_time(t))
+        return std::format("task {} started before dependency {}", t, d);
+    }
+  }
+
+  return std::nullopt;
+}
+
+auto check_thread_pool(const scheduler::Dag& dag,
+                       const std::vector<SimTask>& tasks, std::size_t workers)
+    -> std::optional<std::string> {
+  const auto deps = dag.dependencies();
+
+  std::vector<std::atomic<std::size_t>> runs(dag.size());
+  std::vector<std::atomic<bool>> done(dag.size());
+  std::atomic<bool> out_of_order = false;
+
+  scheduler::ScheduleResult result;
+  {
+    scheduler::ThreadPoolExecutor pool(workers, [&](std::size_t t) {
+      runs[t]++;
+      for (const auto d : deps[t]) {
+        if (!done[d]) out_of_order = true;
+      }
+
+      done[t] = !tasks[t].fail;
+      return !tasks[t].fail;
+    });
+    result = scheduler::schedule(dag, pool);
+  }
+
+  if (out_of_order) return "task started before its dependencies";
+
+  for (std::size_t t = 0; t < dag.size(); ++t) {
+    if (runs[t] > 1)
+      return std::format("task {} ran {} times", t, runs[t].load());
+
+    if (runs[t] == 0 && !result.failed)
+      return std::format("task {} never ran", t);
+  }
+
+  return std::nullopt;
+}
+
+// Schedules many small random graphs, with random worker counts and injected
+// failures, on both executors and checks the ordering invariants
+export auto run_stress(std::size_t iterations, std::uint64_t seed) -> bool {
+  std::mt19937_64 rng(seed);
+
+  std::uniform_int_distribution<std::size_t> nodes(1, 2000);
+  std::uniform_int_distribution<std::size_t> window(1, 200);
+  std::uniform_int_distribution<std::size_t> max_deps(0, 10);
+  std::uniform_int_distribution<std::size_t> workers(1, 64);
+  std::bernoulli_distribution inject(0.2);
+
+  for (std::size_t i = 0; i < iterations; ++i) {
+    const GraphOptions opts{
+        .nodes = nodes(rng),
+        .window = window(rng),
+        .max_deps = max_deps(rng),
+        .min_duration = 1,
+        .max_duration = 1000,
+        .fail_rate = inject(rng) ? 0.001 : 0.0,
+    };
+    const auto w = workers(rng);
+    const auto [dag, tasks] = random_graph(opts, rng);
+
+    SimulatedExecutor sim(tasks, w);
+    const auto result = scheduler::schedule(dag, sim);
+
+    auto error = check_simulated(dag, tasks, sim, result);
+    if (!error.has_value()) error = check_thread_pool(dag, tasks, w);
+
+    if (error.has_value()) {
+      log::error("Stress iteration {} ({} tasks, {} workers): {}", i,
+                 dag.size(), w, error.value());
+      return false;
+    }
+
+    ansi::reset_line();
+    log::info("Stress iterations: {}/{}", i + 1, iterations);
+  }
+
+  log::info("All schedules valid");
+  return true;
+}
+
+}  // namespace sim
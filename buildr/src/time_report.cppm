@@ -0,0 +1,213 @@
+module;
+
+#include <boost/describe.hpp>
+#include <boost/json.hpp>
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <optional>
+#include <print>
+#include <ranges>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "format.hpp"
+
+export module time_report;
+
+import ansi_mod;
+import logging;
+
+namespace report {
+
+namespace fs = std::filesystem;
+namespace r = std::ranges;
+namespace rv = r::views;
+
+constexpr std::size_t kTableRows = 10;
+constexpr std::size_t kJsonRows = 100;
+constexpr std::size_t kNameWidth = 80;
+
+// Times are inclusive, a header's parse time includes the headers it includes
+struct Hotspot {
+  std::string name;
+  double total_ms = 0;
+  std::size_t count = 0;
+  std::size_t tus = 0;
+};
+BOOST_DESCRIBE_STRUCT(Hotspot, (), (name, total_ms, count, tus));
+
+struct TimeReport {
+  std::size_t tus = 0;
+  double total_ms = 0;
+  std::vector<Hotspot> headers;
+  std::vector<Hotspot> modules;
+  std::vector<Hotspot> instantiations;
+};
+BOOST_DESCRIBE_STRUCT(TimeReport, (),
+                      (tus, total_ms, headers, modules, instantiations));
+
+using totals_t = std::map<std::string, Hotspot>;
+
+struct TuTrace {
+  double total_ms = 0;
+  totals_t headers;
+  totals_t modules;
+  totals_t instantiations;
+};
+
+auto add_event(totals_t& totals, const std::string& name, double ms) {
+  auto& h = totals[name];
+  h.name = name;
+  h.total_ms += ms;
+  h.count++;
+}
+
+// See clang's -ftime-trace output, it's the chrome trace event format with
+// durations in microseconds
+auto parse_trace(const fs::path& file) -> std::optional<TuTrace> {
+  std::ifstream f(file);
+  if (!f) return std::nullopt;
+
+  std::stringstream ss;
+  ss << f.rdbuf();
+
+  boost::system::error_code ec;
+  const auto json = boost::json::parse(ss.str(), ec);
+  if (ec) {
+    log::warn("Failed to parse time trace {}: {}", file, ec.message());
+    return std::nullopt;
+  }
+
+  const auto* events = json.is_object()
+                           ? json.as_object().if_contains("traceEvents")
+                           : nullptr;
+  if (events == nullptr || !events->is_array()) {
+    log::warn("Time trace {} has no traceEvents array", file);
+    return std::nullopt;
+  }
+
+  TuTrace trace;
+  for (const auto& e : events->as_array()) {
+    const auto* event = e.if_object();
+    if (event == nullptr) continue;
+
+    const auto* name = event->if_contains("name");
+    const auto* dur = event->if_contains("dur");
+    if (name == nullptr || !name->is_string() || dur == nullptr ||
+        !dur->is_number())
+      continue;
+
+    std::string detail;
+    if (const auto* args = event->if_contains("args");
+        args != nullptr && args->is_object()) {
+      if (const auto* d = args->as_object().if_contains("detail");
+          d != nullptr && d->is_string())
+        detail = d->as_string();
+    }
+
+    const auto ms = dur->to_number<double>() / 1000.0;
+    const auto& n = name->as_string();
+
+    if (n == "ExecuteCompiler") {
+      trace.total_ms += ms;
+    } else if (n == "Source") {
+      add_event(trace.headers, detail, ms);
+    } else if (n == "ReadAST") {
+      add_event(trace.modules, detail, ms);
+    } else if (n == "InstantiateClass" || n == "InstantiateFunction") {
+      add_event(trace.instantiations, detail, ms);
+    }
+  }
+
+  return trace;
+}
+
+auto merge(totals_t& into, const totals_t& tu) {
+  for (const auto& [name, h] : tu) {
+    auto& total = into[name];
+    total.name = name;
+    total.total_ms += h.total_ms;
+    total.count += h.count;
+    total.tus++;
+  }
+}
+
+auto ranked(const totals_t& totals) {
+  auto rows = totals | rv::values | r::to<std::vector>();
+  r::sort(rows, r::greater{}, &Hotspot::total_ms);
+  return rows;
+}
+
+auto shorten(const std::string& name) {
+  if (name.size() <= kNameWidth) return name;
+  return "..." + name.substr(name.size() - kNameWidth + 3);
+}
+
+void print_table(std::string_view title, const std::vector<Hotspot>& rows) {
+  std::println("\n{}{}{}", ansi::kGreen, title, ansi::kReset);
+  std::println("{:>12} {:>8} {:>6}  {}", "total (ms)", "count", "TUs", "name");
+  for (const auto& h : rows | rv::take(kTableRows)) {
+    std::println("{:>12.1f} {:>8} {:>6}  {}", h.total_ms, h.count, h.tus,
+                 shorten(h.name));
+  }
+}
+
+// Aggregates the per TU traces into a ranked report, printing the top entries
+// and writing the rest to out as json
+export auto write_time_report(const std::vector<fs::path>& traces,
+                              const fs::path& out) {
+  TimeReport report;
+  totals_t headers;
+  totals_t modules;
+  totals_t instantiations;
+
+  std::vector<fs::path> missing;
+  for (const auto& t : traces) {
+    if (!fs::exists(t)) {
+      missing.push_back(t);
+      continue;
+    }
+
+    const auto trace = parse_trace(t);
+    if (!trace.has_value()) continue;
+
+    report.tus++;
+    report.total_ms += trace->total_ms;
+    merge(headers, trace->headers);
+    merge(modules, trace->modules);
+    merge(instantiations, trace->instantiations);
+  }
+
+  // Every TU in the build graph is compiled with a trace, so these sources
+  // were not part of the scanned graph
+  if (!missing.empty()) {
+    log::warn("{} of {} sources have no time trace, they are not in the build "
+              "graph: {}",
+              missing.size(), traces.size(), missing);
+  }
+
+  report.headers = ranked(headers);
+  report.modules = ranked(modules);
+  report.instantiations = ranked(instantiations);
+
+  std::println("\n{}Compile time report{} ({} TUs, {:.1f} ms)", ansi::kBlue,
+               ansi::kReset, report.tus, report.total_ms);
+  print_table("Headers by total parse time", report.headers);
+  print_table("Module imports by load time", report.modules);
+  print_table("Template instantiations", report.instantiations);
+
+  for (auto* rows :
+       {&report.headers, &report.modules, &report.instantiations}) {
+    if (rows->size() > kJsonRows) rows->resize(kJsonRows);
+  }
+
+  std::ofstream f(out);
+  f << boost::json::serialize(boost::json::value_from(report));
+
+  log::info("Time report written to: {}", out);
+}
+
+}  // namespace report
@@ -31,6 +31,7 @@
         nativeBuildInputs = with pkgs; [
           llvm.clang-tools
           llvm.libllvm
+          llvm.lld
           jq
           which
           pkg-config
@@ -102,7 +103,7 @@
 
           installPhase = ''
             mkdir -p $out/bin
-            cp build/buildr $out/bin
+            cp build/debug/buildr $out/bin
           '';
         };
 